@@ -0,0 +1,62 @@
+# Round-trip check of the payloads that are too large to be embedded as resources (appended to the
+# bootstrapper, see nbsbuilder\Payload.h). Builds a bootstrapper with a large prerequisite, runs it and
+# compares the file extracted by the launcher with the original one. Reports the build and extraction
+# throughput. Run it after building the solution (Release or Lean configuration):
+#
+#   powershell -ExecutionPolicy Bypass -File LargePayloadCheck.ps1 [-Lean] [-SizeMB 5120]
+#
+# The default size is 5 GB, so the check needs about 15 GB of free space in %TEMP%.
+
+param([switch]$Lean, [int]$SizeMB = 5120)
+
+$ErrorActionPreference = 'Stop'
+
+$builder = if ($Lean) { Join-Path $PSScriptRoot 'Output\Lean\nbsbuilder.exe' } else { Join-Path $PSScriptRoot 'Output\nbsbuilder.exe' }
+$work = Join-Path ([IO.Path]::GetTempPath()) 'nbs-large-payload'
+$extracted = Join-Path ([IO.Path]::GetTempPath()) 'Wix#'
+
+Remove-Item $work -Recurse -Force -ErrorAction SilentlyContinue
+New-Item $work -ItemType Directory | Out-Null
+
+# every 1 MB block is different, so the data read from a wrong offset cannot match the original
+$large = Join-Path $work 'large.bin'
+$random = New-Object System.Random 1
+$block = New-Object byte[] (1024 * 1024)
+$stream = [IO.File]::Create($large)
+for ($i = 0; $i -lt $SizeMB; $i++)
+{
+    $random.NextBytes($block)
+    $stream.Write($block, 0, $block.Length)
+}
+$stream.Close()
+
+# the prerequisite is never run as the condition value always exists; the primary setup leaves a marker
+$primary = Join-Path $work 'primary.cmd'
+Set-Content $primary '@echo done> "%~dp0primary.done"' -Encoding Ascii
+
+$setup = Join-Path $work 'setup.exe'
+$condition = 'HKLM:SOFTWARE\Microsoft\Windows\CurrentVersion:ProgramFilesDir'
+
+$build = Measure-Command {
+    & $builder "/out:$setup" "/first:$large" "/second:$primary" "/reg:$condition" '/verify:no' '/local' | Out-Host
+}
+if ($LASTEXITCODE -ne 0) { throw "nbsbuilder failed (exit code $LASTEXITCODE)" }
+
+Remove-Item (Join-Path $extracted 'large.bin'), (Join-Path $extracted 'primary.done') -ErrorAction SilentlyContinue
+
+$run = Measure-Command {
+    $process = Start-Process $setup -Wait -PassThru
+}
+if ($process.ExitCode -ne 0) { throw "bootstrapper failed (exit code $($process.ExitCode))" }
+
+if (-not (Test-Path (Join-Path $extracted 'primary.done'))) { throw 'the primary setup has not been run' }
+
+$expected = (Get-FileHash $large -Algorithm SHA256).Hash
+$actual = (Get-FileHash (Join-Path $extracted 'large.bin') -Algorithm SHA256).Hash
+if ($expected -ne $actual) { throw "the extracted file differs from the original one ($actual, expected $expected)" }
+
+'Round trip OK: {0} MB' -f $SizeMB
+'  build   : {0:N1} s, {1:N0} MB/s' -f $build.TotalSeconds, ($SizeMB / $build.TotalSeconds)
+'  extract : {0:N1} s, {1:N0} MB/s' -f $run.TotalSeconds, ($SizeMB / $run.TotalSeconds)
+
+Remove-Item $work, (Join-Path $extracted 'large.bin'), (Join-Path $extracted 'primary.done') -Recurse -Force -ErrorAction SilentlyContinue
@@ -18,6 +18,8 @@
 #define IDR_CUSTOM_PREREQ_DATA          133
 #define IDR_CUSTOM_PREREQ_NAME          134
 #define IDR_CUSTOM_CONDITION            135
+#define IDR_CUSTOM_VERIFY               136
+#define IDR_CUSTOM_PAYLOAD_FORMAT       138
 #define IDC_STATIC                      -1
 
 // Next default values for new objects
@@ -25,7 +27,7 @@
 #ifdef APSTUDIO_INVOKED
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NO_MFC                     1
-#define _APS_NEXT_RESOURCE_VALUE        136
+#define _APS_NEXT_RESOURCE_VALUE        139
 #define _APS_NEXT_COMMAND_VALUE         32771
 #define _APS_NEXT_CONTROL_VALUE         1000
 #define _APS_NEXT_SYMED_VALUE           110
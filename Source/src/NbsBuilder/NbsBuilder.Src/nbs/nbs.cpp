@@ -5,9 +5,10 @@
 #include "nbs.h"
 #include "ShellAPI.h"
 #include "Utils.h"
+#include "Payload.h"
 
 
-void ProcessWinResources(wstring& msiFile1, wstring& msiFile2, wstring& regKey, bool& verify);
+bool ProcessWinResources(wstring& msiFile1, wstring& msiFile2, wstring& regKey, bool& verify);
 
 
 int APIENTRY _tWinMain(HINSTANCE hInstance,
@@ -28,7 +29,9 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
     wstring regKey;
     bool verify = true;
 
-    ProcessWinResources(msiFile1, msiFile2, regKey, verify);
+    //never run a partially extracted setup file
+    if (!ProcessWinResources(msiFile1, msiFile2, regKey, verify))
+        return 1;
    
     wstring msiParams = PathGetArgsW(GetCommandLineW());
 
@@ -43,9 +46,7 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
     return 0;
 }
 
-#define IDR_CUSTOM_VERIFY               136
-
-void ProcessWinResources(wstring& msiFile1, wstring& msiFile2, wstring& regKey, bool &verify)
+bool ProcessWinResources(wstring& msiFile1, wstring& msiFile2, wstring& regKey, bool &verify)
 {
     wstring tempDir =  Path::Combine(Path::GetTempDir(), L"Wix#");
 
@@ -56,17 +57,21 @@ void ProcessWinResources(wstring& msiFile1, wstring& msiFile2, wstring& regKey,
     wstring fileName = Utils::DataToString(Resources::Read(IDR_CUSTOM_PREREQ_NAME, L"CUSTOM"));
     
     msiFile1 = Path::Combine(tempDir, fileName);
-    OutputStream::Write(msiFile1, msiData1);
+    if (!Payload::Extract((const BYTE*)msiData1.data(), (DWORD)msiData1.size(), msiFile1.c_str()))
+        return false;
 
     string msiData2 = Resources::Read(IDR_CUSTOM_PRIMARY_DATA, L"CUSTOM"); 
     fileName = Utils::DataToString(Resources::Read(IDR_CUSTOM_PRIMARY_NAME, L"CUSTOM"));
     
     msiFile2 = Path::Combine(tempDir, fileName);
-    OutputStream::Write(msiFile2, msiData2);
+    if (!Payload::Extract((const BYTE*)msiData2.data(), (DWORD)msiData2.size(), msiFile2.c_str()))
+        return false;
      
     regKey = Utils::DataToString(Resources::Read(IDR_CUSTOM_CONDITION, L"CUSTOM")); 
 
     wstring verifyValue = Utils::DataToString(Resources::Read(IDR_CUSTOM_VERIFY, L"CUSTOM")); 
 
     verify = verifyValue != L"no";
+
+    return true;
 }
\ No newline at end of file
@@ -0,0 +1,240 @@
+// nbslean.cpp : Defines the entry point for the lean (CRT-free) build of the application.
+//
+// It is built by the 'Lean' configuration instead of nbs.cpp. The behaviour is the same but it uses
+// only Win32 API: no C++ runtime, no iostreams and no STL. The strings are allocated from a small
+// static arena and the embedded data is unpacked to the temp files directly from the (memory mapped)
+// resources without copying.
+
+#include "stdafx.h"
+#include "nbs.h"
+#include "ShellAPI.h"
+#include "Shlwapi.h"
+#include <intrin.h>
+#include "Payload.h"
+
+#pragma intrinsic(__stosb, __movsb)
+
+//the compiler may still emit calls to these for the struct initialization/copying
+#pragma function(memset, memcpy)
+extern "C" void* __cdecl memset(void* dest, int value, size_t count)
+{
+	__stosb((BYTE*)dest, (BYTE)value, count);
+	return dest;
+}
+
+extern "C" void* __cdecl memcpy(void* dest, const void* src, size_t count)
+{
+	__movsb((BYTE*)dest, (const BYTE*)src, count);
+	return dest;
+}
+
+//All strings the launcher needs are allocated from the static arena, which is never freed.
+//Falls back to the process heap if the embedded strings are unusually large.
+class Arena
+{
+	static BYTE buffer[16 * 1024];
+	static size_t used;
+
+public:
+	static void* Alloc(size_t size)
+	{
+		size = (size + 7) & ~(size_t)7;
+
+		if (used + size <= sizeof(buffer))
+		{
+			void* retval = buffer + used;
+			used += size;
+			return retval;
+		}
+		return ::HeapAlloc(::GetProcessHeap(), HEAP_ZERO_MEMORY, size);
+	}
+};
+
+BYTE Arena::buffer[16 * 1024];
+size_t Arena::used = 0;
+
+class Resource
+{
+public:
+	static const BYTE* Find(int resourceId, DWORD* size)
+	{
+		HRSRC resInfo = ::FindResourceW(NULL, MAKEINTRESOURCEW(resourceId), L"CUSTOM");
+		HGLOBAL resHandle = resInfo ? ::LoadResource(NULL, resInfo) : NULL;
+
+		*size = resHandle ? ::SizeofResource(NULL, resInfo) : 0;
+		return resHandle ? (const BYTE*)::LockResource(resHandle) : NULL;
+	}
+
+	//the string resources are stored as UTF-16 without the terminating zero
+	static LPWSTR ReadString(int resourceId)
+	{
+		DWORD size;
+		const BYTE* data = Find(resourceId, &size);
+
+		DWORD length = size / sizeof(WCHAR);
+		LPWSTR retval = (LPWSTR)Arena::Alloc((length + 1) * sizeof(WCHAR));
+		if (retval)
+		{
+			if (data)
+				memcpy(retval, data, length * sizeof(WCHAR));
+			retval[length] = 0;
+		}
+		return retval;
+	}
+};
+
+class Registry
+{
+public:
+	//<HKEY>:<SubKey>:<ValueName>; '::' stands for ':' within a token (same as Utils::Split)
+	static bool ValueExists(LPWSTR path)
+	{
+		LPWSTR tokens[3] = { path, NULL, NULL };
+		int count = 1;
+
+		LPWSTR dest = path;
+		for (LPWSTR src = path; *src; src++)
+		{
+			if (*src == L':')
+			{
+				if (src[1] == L':')
+				{
+					*dest++ = *src++;
+				}
+				else
+				{
+					*dest++ = 0;
+					if (count < 3)
+						tokens[count++] = dest;
+				}
+			}
+			else
+			{
+				*dest++ = *src;
+			}
+		}
+		*dest = 0;
+
+		if (count < 3)
+			return false;
+
+		HKEY hKey;
+		if (lstrcmpW(tokens[0], L"HKCU") == 0)
+			hKey = HKEY_CURRENT_USER;
+		else if (lstrcmpW(tokens[0], L"HKLM") == 0)
+			hKey = HKEY_LOCAL_MACHINE;
+		else if (lstrcmpW(tokens[0], L"HKCR") == 0)
+			hKey = HKEY_CLASSES_ROOT;
+		else if (lstrcmpW(tokens[0], L"HKU") == 0)
+			hKey = HKEY_USERS;
+		else
+			return false;
+
+		HKEY hOpenedKey;
+		if (::RegOpenKeyExW(hKey, tokens[1], 0, KEY_READ, &hOpenedKey) != ERROR_SUCCESS)
+			return false;
+
+		bool retval = tokens[2][0] == 0 //default value
+			|| ::RegQueryValueExW(hOpenedKey, tokens[2], NULL, NULL, NULL, NULL) == ERROR_SUCCESS;
+
+		::RegCloseKey(hOpenedKey);
+		return retval;
+	}
+};
+
+class Shell
+{
+public:
+	static void RunApp(LPCWSTR app, LPCWSTR params)
+	{
+		SHELLEXECUTEINFOW sei = { sizeof(sei) };
+		sei.fMask = SEE_MASK_NOCLOSEPROCESS;  //ensures hProcess gets the process handle
+		sei.nShow = SW_SHOWNORMAL;
+		sei.lpFile = app;
+		if (params && *params)
+			sei.lpParameters = params;
+
+		if (::ShellExecuteExW(&sei) && sei.hProcess)
+		{
+			::WaitForSingleObject(sei.hProcess, INFINITE);
+			::CloseHandle(sei.hProcess);
+		}
+	}
+};
+
+static LPWSTR ExtractFile(LPCWSTR dir, int dataId, int nameId)
+{
+	LPWSTR file = (LPWSTR)Arena::Alloc(MAX_PATH * 2 * sizeof(WCHAR));
+	LPWSTR name = Resource::ReadString(nameId);
+	if (!file || !name || !::PathCombineW(file, dir, name))
+		return NULL;
+
+	DWORD size;
+	const BYTE* data = Resource::Find(dataId, &size);
+	if (!data || !Payload::Extract(data, size, file))
+		return NULL;
+
+	return file;
+}
+
+static int Run()
+{
+	DWORD size;
+	const BYTE* condition = Resource::Find(IDR_CUSTOM_CONDITION, &size);
+
+	static const char placeholder[] = "HKLM:SOFTWARE\\Microsoft\\.NETFramework:$default";
+	const DWORD placeholderLength = sizeof(placeholder) - 1;
+
+	bool isPlaceholder = size >= placeholderLength
+		&& ::StrCmpNA((LPCSTR)condition, placeholder, placeholderLength) == 0
+		&& (size == placeholderLength || condition[placeholderLength] == 0);
+
+	if (!condition || isPlaceholder)
+	{
+		::MessageBoxW(0, L"Resources are not embedded", L"Wix# Bootstrapper", 0);
+		return 1;
+	}
+
+	WCHAR tempDir[MAX_PATH * 2];
+	WCHAR systemTemp[MAX_PATH * 2];
+	::GetTempPathW(MAX_PATH * 2, systemTemp);
+	::PathCombineW(tempDir, systemTemp, L"Wix#");
+	::CreateDirectoryW(tempDir, NULL);
+
+	LPWSTR msiFile1 = ExtractFile(tempDir, IDR_CUSTOM_PREREQ_DATA, IDR_CUSTOM_PREREQ_NAME);
+	LPWSTR msiFile2 = ExtractFile(tempDir, IDR_CUSTOM_PRIMARY_DATA, IDR_CUSTOM_PRIMARY_NAME);
+	LPWSTR regKey = Resource::ReadString(IDR_CUSTOM_CONDITION);
+	LPWSTR verifyValue = Resource::ReadString(IDR_CUSTOM_VERIFY);
+
+	if (!msiFile1 || !msiFile2 || !regKey || !verifyValue)
+		return 1;
+
+	bool verify = lstrcmpW(verifyValue, L"no") != 0;
+
+	//ValueExists tokenizes the key in place
+	DWORD keyLength = lstrlenW(regKey) + 1;
+	LPWSTR regKeyCopy = (LPWSTR)Arena::Alloc(keyLength * sizeof(WCHAR));
+	if (!regKeyCopy)
+		return 1;
+
+	LPCWSTR msiParams = ::PathGetArgsW(::GetCommandLineW());
+
+	memcpy(regKeyCopy, regKey, keyLength * sizeof(WCHAR));
+	if (!Registry::ValueExists(regKeyCopy))
+		Shell::RunApp(msiFile1, msiParams);
+
+	memcpy(regKeyCopy, regKey, keyLength * sizeof(WCHAR));
+	if (verify && !Registry::ValueExists(regKeyCopy))
+		return 1;
+
+	Shell::RunApp(msiFile2, msiParams);
+
+	return 0;
+}
+
+//Entry point (see the linker settings of the Lean configuration). There is no CRT start up code
+//so the process has to be terminated explicitly.
+extern "C" void WINAPI NbsEntryPoint()
+{
+	::ExitProcess(Run());
+}
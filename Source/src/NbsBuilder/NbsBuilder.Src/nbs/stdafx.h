@@ -20,8 +20,11 @@
 #include <malloc.h>
 #include <memory.h>
 #include <tchar.h>
+
+#ifndef NBS_LEAN
 #include <string>
 #include <fstream>
 using namespace std;
+#endif
 
 // TODO: reference additional headers your program requires here
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <wincrypt.h>
+#include "Utils.h"
+
+#ifndef LOAD_LIBRARY_AS_IMAGE_RESOURCE
+#define LOAD_LIBRARY_AS_IMAGE_RESOURCE 0x00000020
+#endif
+
+class Sha256
+{
+	HCRYPTPROV provider;
+	HCRYPTHASH hash;
+
+public:
+	Sha256()
+	{
+		provider = 0;
+		hash = 0;
+		if (CryptAcquireContextW(&provider, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT))
+			CryptCreateHash(provider, CALG_SHA_256, 0, 0, &hash);
+	}
+
+	~Sha256()
+	{
+		if (hash)
+			CryptDestroyHash(hash);
+		if (provider)
+			CryptReleaseContext(provider, 0);
+	}
+
+	void Append(const void* data, size_t size)
+	{
+		const BYTE* pos = (const BYTE*)data;
+		while (size > 0)
+		{
+			DWORD chunk = size > 0x10000000 ? 0x10000000 : (DWORD)size;
+			CryptHashData(hash, pos, chunk, 0);
+			pos += chunk;
+			size -= chunk;
+		}
+	}
+
+	void Append(const string& data)
+	{
+		Append(data.data(), data.size());
+	}
+
+	string Digest()
+	{
+		string retval;
+		DWORD size = 32;
+		retval.resize(size);
+		if (!CryptGetHashParam(hash, HP_HASHVAL, (BYTE*)retval.data(), &size, 0))
+			retval.clear();
+		return retval;
+	}
+
+	static wstring ToHex(const string& data)
+	{
+		static const WCHAR digits[] = L"0123456789abcdef";
+
+		wstring retval;
+		retval.resize(data.size() * 2);
+		for (UINT i = 0; i < data.size(); i++)
+		{
+			retval[i * 2] = digits[(BYTE)data[i] >> 4];
+			retval[i * 2 + 1] = digits[(BYTE)data[i] & 0xF];
+		}
+		return retval;
+	}
+};
+
+//Post-processing of the PE file produced by EndUpdateResource so the same input always
+//results in the same bytes.
+class PEImage
+{
+	static DWORD RvaToOffset(IMAGE_SECTION_HEADER* sections, int count, DWORD rva)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			DWORD size = max(sections[i].SizeOfRawData, sections[i].Misc.VirtualSize);
+			if (rva >= sections[i].VirtualAddress && rva < sections[i].VirtualAddress + size)
+				return sections[i].PointerToRawData + (rva - sections[i].VirtualAddress);
+		}
+		return 0;
+	}
+
+	static void ClearResourceTimeStamps(BYTE* root, DWORD rootSize, DWORD offset, int level)
+	{
+		//resource tree is always three levels deep: type, name, language
+		if (level > 3 || offset + sizeof(IMAGE_RESOURCE_DIRECTORY) > rootSize)
+			return;
+
+		IMAGE_RESOURCE_DIRECTORY* dir = (IMAGE_RESOURCE_DIRECTORY*)(root + offset);
+		dir->TimeDateStamp = 0;
+
+		IMAGE_RESOURCE_DIRECTORY_ENTRY* entries = (IMAGE_RESOURCE_DIRECTORY_ENTRY*)(dir + 1);
+		int count = dir->NumberOfNamedEntries + dir->NumberOfIdEntries;
+
+		for (int i = 0; i < count; i++)
+		{
+			if ((BYTE*)(entries + i + 1) > root + rootSize)
+				return;
+
+			if (entries[i].DataIsDirectory)
+				ClearResourceTimeStamps(root, rootSize, entries[i].OffsetToDirectory, level + 1);
+		}
+	}
+
+public:
+	//Sets the image time stamp to the specified value and zeros the time stamps of the resource
+	//directories and the image checksum (not required for the executables).
+	static bool Normalize(wstring file, DWORD timeStamp)
+	{
+		bool retval = false;
+
+		HANDLE hFile = ::CreateFileW(file.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		DWORD fileSize = ::GetFileSize(hFile, NULL);
+		HANDLE hMapping = ::CreateFileMappingW(hFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+		BYTE* image = hMapping ? (BYTE*)::MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+
+		if (image && fileSize >= sizeof(IMAGE_DOS_HEADER))
+		{
+			IMAGE_DOS_HEADER* dosHeader = (IMAGE_DOS_HEADER*)image;
+			IMAGE_NT_HEADERS32* ntHeaders = (IMAGE_NT_HEADERS32*)(image + dosHeader->e_lfanew);
+
+			if (dosHeader->e_magic == IMAGE_DOS_SIGNATURE
+				&& dosHeader->e_lfanew > 0
+				&& (DWORD)dosHeader->e_lfanew + sizeof(IMAGE_NT_HEADERS64) <= fileSize
+				&& ntHeaders->Signature == IMAGE_NT_SIGNATURE)
+			{
+				ntHeaders->FileHeader.TimeDateStamp = timeStamp;
+
+				IMAGE_DATA_DIRECTORY* resources;
+				if (ntHeaders->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+				{
+					IMAGE_NT_HEADERS64* ntHeaders64 = (IMAGE_NT_HEADERS64*)ntHeaders;
+					ntHeaders64->OptionalHeader.CheckSum = 0;
+					resources = &ntHeaders64->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_RESOURCE];
+				}
+				else
+				{
+					ntHeaders->OptionalHeader.CheckSum = 0;
+					resources = &ntHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_RESOURCE];
+				}
+
+				IMAGE_SECTION_HEADER* sections = IMAGE_FIRST_SECTION(ntHeaders);
+				int sectionCount = ntHeaders->FileHeader.NumberOfSections;
+
+				if ((BYTE*)(sections + sectionCount) <= image + fileSize)
+				{
+					DWORD offset = resources->VirtualAddress ? RvaToOffset(sections, sectionCount, resources->VirtualAddress) : 0;
+					if (offset != 0 && offset + resources->Size <= fileSize)
+						ClearResourceTimeStamps(image + offset, resources->Size, 0, 1);
+
+					retval = true;
+				}
+			}
+		}
+
+		if (image)
+			::UnmapViewOfFile(image);
+		if (hMapping)
+			::CloseHandle(hMapping);
+		::CloseHandle(hFile);
+
+		return retval;
+	}
+
+	//Reads the resource without loading the whole file so the check is cheap regardless of the file size.
+	//The file is mapped as an image, so the payloads appended after it (see Payload.h) are not mapped at all.
+	static string ReadResource(wstring file, LPCWSTR resType, int resId)
+	{
+		string buffer;
+
+		HMODULE hModule = ::LoadLibraryExW(file.c_str(), NULL, LOAD_LIBRARY_AS_DATAFILE | LOAD_LIBRARY_AS_IMAGE_RESOURCE);
+		if (hModule == NULL)
+			return buffer;
+
+		HRSRC resInfo = ::FindResourceW(hModule, MAKEINTRESOURCEW(resId), resType);
+		if (resInfo)
+		{
+			HGLOBAL resHandle = ::LoadResource(hModule, resInfo);
+			DWORD resSize = ::SizeofResource(hModule, resInfo);
+			BYTE* pData = (BYTE*)::LockResource(resHandle);
+
+			if (pData)
+			{
+				buffer.resize(resSize);
+				memcpy((char*)buffer.data(), pData, resSize);
+			}
+		}
+
+		::FreeLibrary(hModule);
+
+		return buffer;
+	}
+};
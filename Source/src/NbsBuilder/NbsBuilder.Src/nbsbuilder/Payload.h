@@ -0,0 +1,219 @@
+#pragma once
+
+//Layout of the embedded payloads (prerequisite and primary setup files). Shared by the builder and both
+//builds of the launcher, so it uses only Win32 API (no CRT, no 64-bit multiplication/division).
+//
+//<PayloadHeader><PayloadBlock><block data><PayloadBlock><block data>...
+//
+//Every block holds PayloadHeader::blockSize bytes of the original file (the last one may be shorter) and
+//is either stored as is or compressed with LZNT1 (RtlCompressBuffer), which is available on all supported
+//versions of Windows.
+//
+//The files too large to be resources are appended to the bootstrapper as is, after the end of the last
+//section of the PE image (overlay). Their data resource holds the PayloadReference instead and the launcher
+//reads them from its own file. Anything appended later (e.g. Authenticode signature) does not move them.
+
+#define NBS_PAYLOAD_MAGIC               0x3153424E //'NBS1', also the content of the launcher's payload format resource (nbs.rc)
+#define NBS_PAYLOAD_BLOCK_SIZE          (1024 * 1024)
+
+#define NBS_CODEC_STORE                 0
+#define NBS_CODEC_FAST                  1 //LZNT1, standard engine
+#define NBS_CODEC_STRONG                2 //LZNT1, maximum engine
+
+#define NBS_OVERLAY_MAGIC               0x4F53424E //'NBSO'
+#define NBS_HEADERS_SIZE                4096       //the PE headers including the section table are within the first page
+
+#pragma pack(push, 1)
+struct PayloadHeader
+{
+	DWORD magic;
+	DWORD blockSize;
+	ULONGLONG size;         //size of the original file
+	BYTE codec;             //codec chosen for the payload; the blocks that do not compress are still stored
+	BYTE reserved[7];
+};
+
+struct PayloadBlock
+{
+	DWORD packedSize;
+	BYTE codec;
+	BYTE reserved[3];
+};
+
+struct PayloadReference
+{
+	DWORD magic;
+	DWORD reserved;
+	ULONGLONG offset;       //from the end of the PE image
+	ULONGLONG size;
+};
+#pragma pack(pop)
+
+class Payload
+{
+	typedef LONG(WINAPI *RtlDecompressBufferFn)(USHORT format, PUCHAR uncompressed, ULONG uncompressedSize, PUCHAR compressed, ULONG compressedSize, PULONG finalSize);
+
+	static bool Write(HANDLE hFile, const BYTE* data, DWORD size)
+	{
+		DWORD written = 0;
+		return ::WriteFile(hFile, data, size, &written, NULL) && written == size;
+	}
+
+	static bool Unpack(const BYTE* data, DWORD size, HANDLE hFile)
+	{
+		PayloadHeader header;
+		memcpy(&header, data, sizeof(header));
+
+		if (header.blockSize == 0)
+			return false;
+
+		RtlDecompressBufferFn decompress = (RtlDecompressBufferFn)::GetProcAddress(::GetModuleHandleW(L"ntdll.dll"), "RtlDecompressBuffer");
+		BYTE* buffer = (BYTE*)::HeapAlloc(::GetProcessHeap(), 0, header.blockSize);
+
+		const BYTE* pos = data + sizeof(header);
+		const BYTE* end = data + size;
+		ULONGLONG remaining = header.size;
+		bool retval = decompress != NULL && buffer != NULL;
+
+		while (retval && remaining > 0)
+		{
+			PayloadBlock block;
+			if ((DWORD)(end - pos) < sizeof(block))
+			{
+				retval = false;
+				break;
+			}
+			memcpy(&block, pos, sizeof(block));
+			pos += sizeof(block);
+
+			DWORD blockSize = remaining < header.blockSize ? (DWORD)remaining : header.blockSize;
+
+			if ((DWORD)(end - pos) < block.packedSize)
+			{
+				retval = false;
+			}
+			else if (block.codec == NBS_CODEC_STORE)
+			{
+				retval = block.packedSize == blockSize && Write(hFile, pos, blockSize);
+			}
+			else
+			{
+				ULONG unpackedSize = 0;
+				retval = decompress(COMPRESSION_FORMAT_LZNT1, buffer, blockSize, (PUCHAR)pos, block.packedSize, &unpackedSize) == 0
+					&& unpackedSize == blockSize
+					&& Write(hFile, buffer, blockSize);
+			}
+
+			pos += block.packedSize;
+			remaining -= blockSize;
+		}
+
+		if (buffer)
+			::HeapFree(::GetProcessHeap(), 0, buffer);
+
+		return retval;
+	}
+
+	//copies the appended payload from the launcher's own file
+	static bool CopyOverlay(const BYTE* data, HANDLE hFile)
+	{
+		PayloadReference reference;
+		memcpy(&reference, data, sizeof(reference));
+
+		WCHAR path[MAX_PATH * 2];
+		DWORD length = ::GetModuleFileNameW(NULL, path, MAX_PATH * 2);
+		DWORD imageEnd = ImageEnd((const BYTE*)::GetModuleHandleW(NULL), NBS_HEADERS_SIZE);
+
+		if (length == 0 || length >= MAX_PATH * 2 || imageEnd == 0)
+			return false;
+
+		HANDLE hImage = ::CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hImage == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER offset, fileSize;
+		offset.QuadPart = (LONGLONG)(imageEnd + reference.offset);
+
+		BYTE* buffer = (BYTE*)::HeapAlloc(::GetProcessHeap(), 0, NBS_PAYLOAD_BLOCK_SIZE);
+
+		bool retval = buffer != NULL
+			&& ::GetFileSizeEx(hImage, &fileSize)
+			&& offset.QuadPart <= fileSize.QuadPart
+			&& reference.size <= (ULONGLONG)(fileSize.QuadPart - offset.QuadPart)
+			&& ::SetFilePointerEx(hImage, offset, NULL, FILE_BEGIN);
+
+		ULONGLONG remaining = reference.size;
+
+		while (retval && remaining > 0)
+		{
+			DWORD chunk = remaining < NBS_PAYLOAD_BLOCK_SIZE ? (DWORD)remaining : NBS_PAYLOAD_BLOCK_SIZE;
+			DWORD read = 0;
+
+			retval = ::ReadFile(hImage, buffer, chunk, &read, NULL) && read == chunk && Write(hFile, buffer, chunk);
+			remaining -= chunk;
+		}
+
+		if (buffer)
+			::HeapFree(::GetProcessHeap(), 0, buffer);
+
+		::CloseHandle(hImage);
+		return retval;
+	}
+
+public:
+	static bool IsPacked(const BYTE* data, DWORD size)
+	{
+		return size >= sizeof(PayloadHeader) && ((PayloadHeader*)data)->magic == NBS_PAYLOAD_MAGIC;
+	}
+
+	static bool IsReference(const BYTE* data, DWORD size)
+	{
+		return size == sizeof(PayloadReference) && ((PayloadReference*)data)->magic == NBS_OVERLAY_MAGIC;
+	}
+
+	//Returns the file offset of the end of the last section (i.e. where the overlay starts) or 0 if the
+	//headers are not valid. Used by the builder for the file and by the launcher for its mapped image.
+	static DWORD ImageEnd(const BYTE* headers, DWORD size)
+	{
+		const IMAGE_DOS_HEADER* dosHeader = (const IMAGE_DOS_HEADER*)headers;
+		if (size < sizeof(IMAGE_DOS_HEADER)
+			|| dosHeader->e_magic != IMAGE_DOS_SIGNATURE
+			|| dosHeader->e_lfanew <= 0
+			|| (DWORD)dosHeader->e_lfanew + sizeof(IMAGE_NT_HEADERS32) > size)
+			return 0;
+
+		const IMAGE_NT_HEADERS32* ntHeaders = (const IMAGE_NT_HEADERS32*)(headers + dosHeader->e_lfanew);
+		if (ntHeaders->Signature != IMAGE_NT_SIGNATURE)
+			return 0;
+
+		const IMAGE_SECTION_HEADER* sections = IMAGE_FIRST_SECTION(ntHeaders);
+		int count = ntHeaders->FileHeader.NumberOfSections;
+		if ((const BYTE*)(sections + count) > headers + size)
+			return 0;
+
+		DWORD retval = 0;
+		for (int i = 0; i < count; i++)
+		{
+			DWORD end = sections[i].PointerToRawData + sections[i].SizeOfRawData;
+			if (sections[i].SizeOfRawData != 0 && end > retval)
+				retval = end;
+		}
+		return retval;
+	}
+
+	//Writes the original file content. The data that is neither a packed payload nor a reference to the
+	//appended one is written as is.
+	static bool Extract(const BYTE* data, DWORD size, LPCWSTR fileName)
+	{
+		HANDLE hFile = ::CreateFileW(fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		bool retval = IsReference(data, size) ? CopyOverlay(data, hFile)
+			: IsPacked(data, size) ? Unpack(data, size, hFile)
+			: Write(hFile, data, size);
+
+		::CloseHandle(hFile);
+		return retval;
+	}
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <math.h>
+#include "Utils.h"
+#include "Payload.h"
+
+#define NBS_SAMPLE_COUNT                8
+#define NBS_SAMPLE_SIZE                 (64 * 1024)
+
+//Larger files are appended to the bootstrapper instead of being embedded as resources (see Payload.h).
+//The launcher is a 32-bit process, which maps its whole image including the resources into memory.
+#define NBS_MAX_RESOURCE_PAYLOAD        (512 * 1024 * 1024)
+
+struct PayloadStats
+{
+	ULONGLONG size;
+	ULONGLONG packedSize;
+	double entropy;         //bits per byte, average of the sampled blocks
+	double predictedRatio;  //packed/original size predicted from the trial compression of the sampled blocks
+	BYTE codec;
+	DWORD blocks;
+	DWORD storedBlocks;     //blocks stored as is because they do not compress
+	bool appended;          //appended after the image (not packed), see NBS_MAX_RESOURCE_PAYLOAD
+
+	double ActualRatio()
+	{
+		return size ? (double)packedSize / size : 1.0;
+	}
+
+	const char* CodecName()
+	{
+		return codec == NBS_CODEC_STRONG ? "strong" : codec == NBS_CODEC_FAST ? "fast" : "store";
+	}
+};
+
+//Packs the file content into the payload (see Payload.h). The codec is chosen by sampling the data:
+//already compressed data (e.g. MSI with the embedded cabinets) is stored, well compressible data is
+//packed with the strong codec and everything else with the fast one.
+class PayloadWriter
+{
+	typedef LONG(WINAPI *RtlCompressBufferFn)(USHORT format, PUCHAR uncompressed, ULONG uncompressedSize, PUCHAR compressed, ULONG compressedSize, ULONG chunkSize, PULONG finalSize, PVOID workspace);
+	typedef LONG(WINAPI *RtlGetCompressionWorkSpaceSizeFn)(USHORT format, PULONG workspaceSize, PULONG fragmentWorkspaceSize);
+
+	RtlCompressBufferFn compress;
+	string workspace;
+
+	static USHORT Format(BYTE codec)
+	{
+		return COMPRESSION_FORMAT_LZNT1 | (codec == NBS_CODEC_STRONG ? COMPRESSION_ENGINE_MAXIMUM : COMPRESSION_ENGINE_STANDARD);
+	}
+
+	//returns false if the data cannot be compressed (or does not get any smaller)
+	bool Compress(BYTE codec, const BYTE* data, DWORD size, string& output)
+	{
+		if (compress == NULL || size == 0)
+			return false;
+
+		output.resize(size);
+		ULONG packedSize = 0;
+
+		LONG status = compress(Format(codec), (PUCHAR)data, size, (PUCHAR)output.data(), (ULONG)output.size(), 4096, &packedSize, (PVOID)workspace.data());
+		if (status != 0 || packedSize == 0 || packedSize >= size)
+			return false;
+
+		output.resize(packedSize);
+		return true;
+	}
+
+public:
+	PayloadWriter()
+	{
+		HMODULE ntdll = ::GetModuleHandleW(L"ntdll.dll");
+		compress = (RtlCompressBufferFn)::GetProcAddress(ntdll, "RtlCompressBuffer");
+		RtlGetCompressionWorkSpaceSizeFn getWorkspaceSize = (RtlGetCompressionWorkSpaceSizeFn)::GetProcAddress(ntdll, "RtlGetCompressionWorkSpaceSize");
+
+		ULONG workspaceSize = 0, fragmentWorkspaceSize = 0;
+		if (getWorkspaceSize == NULL || getWorkspaceSize(Format(NBS_CODEC_STRONG), &workspaceSize, &fragmentWorkspaceSize) != 0)
+			compress = NULL;
+		else
+			workspace.resize(workspaceSize);
+	}
+
+	static double Entropy(const BYTE* data, size_t size)
+	{
+		if (size == 0)
+			return 0;
+
+		size_t counts[256] = { 0 };
+		for (size_t i = 0; i < size; i++)
+			counts[data[i]]++;
+
+		double retval = 0;
+		for (int i = 0; i < 256; i++)
+			if (counts[i])
+			{
+				double p = (double)counts[i] / size;
+				retval -= p * log(p) / log(2.0);
+			}
+
+		return retval;
+	}
+
+	BYTE ChooseCodec(InputStream& input, __int64 size, PayloadStats& stats)
+	{
+		DWORD sampleSize = (DWORD)min((__int64)NBS_SAMPLE_SIZE, size);
+		int sampleCount = (int)min((__int64)NBS_SAMPLE_COUNT, size / max(sampleSize, (DWORD)1));
+
+		double entropy = 0;
+		int sampled = 0;
+		ULONGLONG packed = 0;
+		string sample, output;
+		sample.resize(sampleSize);
+
+		for (int i = 0; i < sampleCount; i++)
+		{
+			//evenly spread over the whole file
+			__int64 offset = (__int64)((size - sampleSize) * ((double)i / max(sampleCount - 1, 1)));
+
+			input.SetOffset(offset);
+			if (!input.ReadData((void*)sample.data(), sampleSize))
+				break;
+
+			entropy += Entropy((const BYTE*)sample.data(), sampleSize);
+			sampled++;
+			packed += Compress(NBS_CODEC_FAST, (const BYTE*)sample.data(), sampleSize, output) ? output.size() : sampleSize;
+		}
+
+		stats.entropy = sampled ? entropy / sampled : 8.0;
+		stats.predictedRatio = sampled ? (double)packed / ((ULONGLONG)sampled * sampleSize) : 1.0;
+
+		if (compress == NULL || stats.entropy > 7.9 || stats.predictedRatio > 0.97)
+			return NBS_CODEC_STORE;
+		else if (stats.predictedRatio < 0.6)
+			return NBS_CODEC_STRONG;
+		else
+			return NBS_CODEC_FAST;
+	}
+
+	//Reads and packs the file one block at a time, so apart from the payload itself only a couple of blocks
+	//are held in memory. Returns false (and empty payload) if the file cannot be read or the payload does not
+	//fit into the process memory or into a resource (4GB).
+	bool Pack(wstring file, string& payload, PayloadStats& stats)
+	{
+		string().swap(payload);
+		ZeroMemory(&stats, sizeof(stats));
+
+		__int64 size = InputStream::Length(file);
+		InputStream input(file);
+		if (size < 0 || !input.IsValid())
+			return false;
+
+		//the stored blocks are the upper limit of the payload size
+		__int64 blockCount = (size + NBS_PAYLOAD_BLOCK_SIZE - 1) / NBS_PAYLOAD_BLOCK_SIZE;
+		__int64 storedSize = sizeof(PayloadHeader) + blockCount * sizeof(PayloadBlock) + size;
+		if (storedSize > MAXDWORD || (unsigned __int64)storedSize > payload.max_size())
+			return false;
+
+		stats.size = size;
+		stats.codec = ChooseCodec(input, size, stats);
+
+		PayloadHeader header = { 0 };
+		header.magic = NBS_PAYLOAD_MAGIC;
+		header.blockSize = NBS_PAYLOAD_BLOCK_SIZE;
+		header.size = size;
+		header.codec = stats.codec;
+
+		try
+		{
+			//avoids reallocation (and so the temporary second copy of the payload) in most cases
+			double expectedRatio = stats.codec == NBS_CODEC_STORE ? 1.0 : min(stats.predictedRatio * 1.1, 1.0);
+			payload.reserve((size_t)(storedSize * expectedRatio));
+			payload.append((const char*)&header, sizeof(header));
+
+			string block, output;
+			block.resize(NBS_PAYLOAD_BLOCK_SIZE);
+
+			input.SetOffset(0);
+			for (__int64 offset = 0; offset < size; offset += NBS_PAYLOAD_BLOCK_SIZE)
+			{
+				DWORD blockSize = (DWORD)min((__int64)NBS_PAYLOAD_BLOCK_SIZE, size - offset);
+				const BYTE* data = (const BYTE*)block.data();
+
+				if (!input.ReadData((void*)block.data(), blockSize))
+				{
+					string().swap(payload);
+					return false;
+				}
+
+				PayloadBlock blockHeader = { 0 };
+				blockHeader.codec = stats.codec;
+
+				//high entropy blocks (e.g. embedded cabinets) are not worth trying even if the rest of the file compresses well
+				if (stats.codec == NBS_CODEC_STORE || Entropy(data, blockSize) > 7.95 || !Compress(stats.codec, data, blockSize, output))
+				{
+					blockHeader.codec = NBS_CODEC_STORE;
+					blockHeader.packedSize = blockSize;
+					payload.append((const char*)&blockHeader, sizeof(blockHeader));
+					payload.append((const char*)data, blockSize);
+
+					if (stats.codec != NBS_CODEC_STORE)
+						stats.storedBlocks++;
+				}
+				else
+				{
+					blockHeader.packedSize = (DWORD)output.size();
+					payload.append((const char*)&blockHeader, sizeof(blockHeader));
+					payload.append(output);
+				}
+				stats.blocks++;
+			}
+		}
+		catch (bad_alloc&)
+		{
+			string().swap(payload);
+			return false;
+		}
+
+		stats.packedSize = payload.size();
+		return true;
+	}
+};
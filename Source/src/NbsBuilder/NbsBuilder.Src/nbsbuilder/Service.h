@@ -0,0 +1,428 @@
+#pragma once
+
+#include <map>
+#include <sddl.h>
+#include "Utils.h"
+#include "resource.h"
+#include "PEImage.h"
+#include "PayloadWriter.h"
+
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+#define PIPE_REJECT_REMOTE_CLIENTS 0x00000008
+#endif
+
+#define MAX_CACHE_SIZE (256 * 1024 * 1024)
+
+//how long the client waits for the server that is busy with another build before building locally
+#define SERVER_CONNECT_TIMEOUT 5000
+
+//how long either side waits for the other one to send or read a message (except for the build itself)
+#define PIPE_IO_TIMEOUT 5000
+
+//the largest request or response accepted; command lines and build outputs are far smaller
+#define MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+
+//Keeps the launcher stub and the packed input files (payloads) in memory between builds. The payload
+//is reused only if the file size and the last write time are the same as at the time of caching.
+class BuildCache
+{
+	struct Entry
+	{
+		ULONGLONG size;
+		FILETIME lastWriteTime;
+		string payload;
+		PayloadStats stats;
+	};
+
+	map<wstring, Entry> files;
+	size_t cachedSize;
+	size_t maxSize;
+	string uncached;
+	string launcher;
+	PayloadWriter writer;
+
+public:
+	//maxSize is the total size of the payloads to keep; 0 disables caching (single build)
+	BuildCache(size_t maxSize)
+	{
+		this->maxSize = maxSize;
+		cachedSize = 0;
+	}
+
+	void Clear()
+	{
+		files.clear();
+		cachedSize = 0;
+		EndBuild();
+	}
+
+	//releases the payload that is not kept for the next builds
+	void EndBuild()
+	{
+		string().swap(uncached);
+	}
+
+	string& Launcher()
+	{
+		if (launcher.empty())
+			launcher = Resources::Read(IDR_CUSTOM1, L"CUSTOM");
+
+		return launcher;
+	}
+
+	//Returns empty buffer if the file cannot be read or packed (see PayloadWriter::Pack).
+	//The returned payload is valid only until the next call.
+	const string& ReadPayload(wstring path, PayloadStats& stats)
+	{
+		//the payload that was not cached is no longer needed
+		string().swap(uncached);
+
+		WIN32_FILE_ATTRIBUTE_DATA info;
+		if (maxSize == 0 || !GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &info))
+		{
+			writer.Pack(path, uncached, stats);
+			return uncached;
+		}
+
+		ULONGLONG size = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+
+		wstring key = path;
+		CharLowerBuffW((LPWSTR)key.data(), (DWORD)key.length());
+
+		map<wstring, Entry>::iterator item = files.find(key);
+		if (item != files.end())
+		{
+			if (item->second.size == size && CompareFileTime(&item->second.lastWriteTime, &info.ftLastWriteTime) == 0)
+			{
+				stats = item->second.stats;
+				return item->second.payload;
+			}
+
+			cachedSize -= item->second.payload.size();
+			files.erase(item);
+		}
+
+		if (!writer.Pack(path, uncached, stats) || uncached.size() > maxSize)
+			return uncached;
+
+		if (cachedSize + uncached.size() > maxSize)
+		{
+			files.clear();
+			cachedSize = 0;
+		}
+
+		Entry& entry = files[key];
+		entry.size = size;
+		entry.lastWriteTime = info.ftLastWriteTime;
+		entry.payload.swap(uncached);
+		entry.stats = stats;
+		cachedSize += entry.payload.size();
+
+		return entry.payload;
+	}
+};
+
+//Length-prefixed blocks exchanged between the build client and the build server.
+//Messages are length-prefixed blocks. The pipe is opened for overlapped I/O and every transfer has a
+//deadline, so a peer that connects and then stops sending or reading cannot block the other side forever.
+class Pipe
+{
+	//reads or writes the whole buffer within the timeout (ms)
+	static bool Transfer(HANDLE pipe, bool write, char* pos, DWORD size, DWORD timeout)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.hEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (overlapped.hEvent == NULL)
+			return false;
+
+		DWORD start = ::GetTickCount();
+		bool success = true;
+
+		while (success && size > 0)
+		{
+			DWORD elapsed = ::GetTickCount() - start;
+			DWORD remaining = timeout == INFINITE ? INFINITE : (elapsed < timeout ? timeout - elapsed : 0);
+
+			DWORD done = 0;
+			BOOL started = write
+				? ::WriteFile(pipe, pos, size, NULL, &overlapped)
+				: ::ReadFile(pipe, pos, size, NULL, &overlapped);
+
+			success = Complete(pipe, overlapped, started, remaining, done) && done != 0;
+			pos += done;
+			size -= done;
+		}
+
+		::CloseHandle(overlapped.hEvent);
+		return success;
+	}
+
+public:
+	//Waits for the overlapped operation that has been started on the handle. On timeout the operation is
+	//cancelled and waited for, as the buffer and the OVERLAPPED must stay valid until it is finished.
+	static bool Complete(HANDLE handle, OVERLAPPED& overlapped, BOOL started, DWORD timeout, DWORD& done)
+	{
+		if (!started && GetLastError() != ERROR_IO_PENDING)
+			return false;
+
+		if (::WaitForSingleObject(overlapped.hEvent, timeout) != WAIT_OBJECT_0)
+		{
+			::CancelIo(handle);
+			::GetOverlappedResult(handle, &overlapped, &done, TRUE);
+			return false;
+		}
+
+		return ::GetOverlappedResult(handle, &overlapped, &done, FALSE) ? true : false;
+	}
+
+	static bool Write(HANDLE pipe, const string& data, DWORD timeout)
+	{
+		DWORD size = (DWORD)data.size();
+
+		string message;
+		message.append((const char*)&size, sizeof(size));
+		message.append(data);
+
+		return Transfer(pipe, true, (char*)message.data(), (DWORD)message.size(), timeout);
+	}
+
+	static bool Read(HANDLE pipe, string& data, DWORD timeout)
+	{
+		DWORD size = 0;
+		if (!Transfer(pipe, false, (char*)&size, sizeof(size), timeout) || size > MAX_MESSAGE_SIZE)
+			return false;
+
+		data.resize(size);
+		return Transfer(pipe, false, (char*)data.data(), size, timeout);
+	}
+
+	//Bounded replacement of FlushFileBuffers (which would wait for a client that stopped reading forever):
+	//the peer closes its end only after it has read the whole response.
+	static void WaitForClose(HANDLE pipe, DWORD timeout)
+	{
+		char byte;
+		Transfer(pipe, false, &byte, sizeof(byte), timeout);
+	}
+};
+
+//Identity of the user the process (build client or build server) runs under.
+class UserSid
+{
+public:
+	//returns empty buffer if the process token cannot be queried
+	static string Of(HANDLE process)
+	{
+		string retval;
+		HANDLE token;
+		if (!::OpenProcessToken(process, TOKEN_QUERY, &token))
+			return retval;
+
+		DWORD size = 0;
+		::GetTokenInformation(token, TokenUser, NULL, 0, &size);
+
+		string buffer;
+		buffer.resize(size);
+		if (size != 0 && ::GetTokenInformation(token, TokenUser, (LPVOID)buffer.data(), size, &size))
+		{
+			PSID sid = ((TOKEN_USER*)buffer.data())->User.Sid;
+			if (::IsValidSid(sid))
+				retval.assign((const char*)sid, ::GetLengthSid(sid));
+		}
+
+		::CloseHandle(token);
+		return retval;
+	}
+
+	static string Current()
+	{
+		return Of(::GetCurrentProcess());
+	}
+
+	static wstring ToString(const string& sid)
+	{
+		wstring retval;
+		LPWSTR text;
+		if (!sid.empty() && ::ConvertSidToStringSidW((PSID)sid.data(), &text))
+		{
+			retval = text;
+			::LocalFree(text);
+		}
+		return retval;
+	}
+};
+
+//Runs builds requested by the nbsbuilder instances (clients) of the same user.
+//The pipe is named after the user SID and only that user can connect to it. There is a single pipe
+//instance for the whole server lifetime, so no other process can take over the name between builds.
+//The name also contains the hash of the embedded launcher, so a client of a different version or
+//configuration (e.g. Lean) never gets the bootstrapper built with the launcher of the server.
+//Request:  <command line> <current directory>
+//Response: <exit code> <build output>
+class BuildServer
+{
+public:
+	typedef int(*BuildHandler)(vector<wstring>& args, wstring curDir, BuildCache& cache, string& output);
+
+	static wstring PipeName()
+	{
+		Sha256 launcher;
+		launcher.Append(Resources::Read(IDR_CUSTOM1, L"CUSTOM"));
+
+		return wstring(L"\\\\.\\pipe\\nbsbuilder-") + UserSid::ToString(UserSid::Current())
+			+ L"-" + Sha256::ToHex(launcher.Digest().substr(0, 8));
+	}
+
+	static int Run(BuildHandler build)
+	{
+		BuildCache cache(MAX_CACHE_SIZE);
+		wstring pipeName = PipeName();
+		bool stopRequested = false;
+
+		//full access for the current user only
+		wstring sddl = L"D:P(A;;GA;;;" + UserSid::ToString(UserSid::Current()) + L")";
+
+		SECURITY_ATTRIBUTES security = { sizeof(security) };
+		if (!::ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl.c_str(), SDDL_REVISION_1, &security.lpSecurityDescriptor, NULL))
+		{
+			printf("Cannot start the build server (error %d).\n", GetLastError());
+			return 1;
+		}
+
+		HANDLE pipe = ::CreateNamedPipeW(pipeName.c_str(),
+			PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+			PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			1, 64 * 1024, 64 * 1024, 0, &security);
+
+		DWORD error = GetLastError();
+		::LocalFree(security.lpSecurityDescriptor);
+
+		if (pipe == INVALID_HANDLE_VALUE)
+		{
+			printf("Cannot start the build server (error %d). Is it already running?\n", error);
+			return 1;
+		}
+
+		OVERLAPPED overlapped = {};
+		overlapped.hEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (overlapped.hEvent == NULL)
+		{
+			printf("Cannot start the build server (error %d).\n", GetLastError());
+			::CloseHandle(pipe);
+			return 1;
+		}
+
+		int retval = 0;
+
+		while (!stopRequested)
+		{
+			DWORD done;
+			BOOL started = ::ConnectNamedPipe(pipe, &overlapped);
+			bool connected = (!started && GetLastError() == ERROR_PIPE_CONNECTED) || Pipe::Complete(pipe, overlapped, started, INFINITE, done);
+			DWORD error = connected ? ERROR_SUCCESS : GetLastError();
+
+			if (connected)
+			{
+				string cmdLine, curDir;
+				if (Pipe::Read(pipe, cmdLine, PIPE_IO_TIMEOUT) && Pipe::Read(pipe, curDir, PIPE_IO_TIMEOUT))
+				{
+					vector<wstring> args = Application::ParseCommandLine(Utils::DataToString(cmdLine));
+
+					for (UINT i = 1; i < args.size(); i++)
+						if (args[i] == L"/server:stop")
+							stopRequested = true;
+
+					int exitCode = 0;
+					string output;
+
+					if (stopRequested)
+						output = "Build server has been stopped.\n";
+					else
+						exitCode = build(args, Utils::DataToString(curDir), cache, output);
+
+					string response;
+					response.resize(sizeof(exitCode));
+					memcpy((void*)response.data(), &exitCode, sizeof(exitCode));
+
+					if (Pipe::Write(pipe, response, PIPE_IO_TIMEOUT) && Pipe::Write(pipe, output, PIPE_IO_TIMEOUT))
+						Pipe::WaitForClose(pipe, PIPE_IO_TIMEOUT);
+				}
+			}
+			else if (error != ERROR_NO_DATA) //ERROR_NO_DATA: the client has already closed its end (e.g. rejected the server)
+			{
+				printf("Build server has stopped (error %d).\n", error);
+				stopRequested = true;
+				retval = 1;
+			}
+
+			//the single pipe instance has to be disconnected whatever the outcome, otherwise it cannot accept the next client
+			::DisconnectNamedPipe(pipe);
+		}
+
+		::CloseHandle(overlapped.hEvent);
+		::CloseHandle(pipe);
+		return retval;
+	}
+};
+
+class BuildClient
+{
+public:
+	//The pipe can be created by any local user before the server starts, so the request is sent only
+	//if the process on the other end runs under the same account as the client.
+	static bool IsTrustedServer(HANDLE pipe)
+	{
+		ULONG processId = 0;
+		if (!::GetNamedPipeServerProcessId(pipe, &processId))
+			return false;
+
+		HANDLE process = ::OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+		if (process == NULL)
+			return false;
+
+		string serverSid = UserSid::Of(process);
+		string clientSid = UserSid::Current();
+		::CloseHandle(process);
+
+		return !serverSid.empty() && !clientSid.empty() && ::EqualSid((PSID)serverSid.data(), (PSID)clientSid.data());
+	}
+
+	//Returns false if there is no (trusted) build server running so the build has to be done locally.
+	//Once the request is sent, the client waits for the exit code without a timeout: the build may take
+	//any time and building locally meanwhile could write the same output file as the server. So a server
+	//that hangs in the build blocks its client until the server is stopped (killed).
+	static bool Send(wstring cmdLine, wstring curDir, int& exitCode, string& output)
+	{
+		wstring pipeName = BuildServer::PipeName();
+
+		HANDLE pipe = ::CreateFileW(pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+		if (pipe == INVALID_HANDLE_VALUE)
+		{
+			//the server is busy with another build; if it does not become available in time the build is done locally
+			if (GetLastError() != ERROR_PIPE_BUSY || !::WaitNamedPipeW(pipeName.c_str(), SERVER_CONNECT_TIMEOUT))
+				return false;
+
+			pipe = ::CreateFileW(pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+			if (pipe == INVALID_HANDLE_VALUE)
+				return false;
+		}
+
+		if (!IsTrustedServer(pipe))
+		{
+			::CloseHandle(pipe);
+			return false;
+		}
+
+		string response;
+		bool success = Pipe::Write(pipe, Utils::StringToData(cmdLine), PIPE_IO_TIMEOUT)
+			&& Pipe::Write(pipe, Utils::StringToData(curDir), PIPE_IO_TIMEOUT)
+			&& Pipe::Read(pipe, response, INFINITE)
+			&& response.size() == sizeof(exitCode)
+			&& Pipe::Read(pipe, output, PIPE_IO_TIMEOUT);
+
+		if (success)
+			memcpy(&exitCode, response.data(), sizeof(exitCode));
+
+		::CloseHandle(pipe);
+		return success;
+	}
+};
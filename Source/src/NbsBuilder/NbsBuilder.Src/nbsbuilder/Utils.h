@@ -1,7 +1,7 @@
 #pragma once
 
 #include <vector>
-#include "comdef.h"
+#include <new>
 #include "Shlwapi.h"
 
 #define MAX_KEY_LENGTH 255
@@ -125,7 +125,12 @@ public:
 		this->file = new ifstream(name.c_str(), ios::in | ios::binary);
 	}
 
-	void SetOffset(long offset, bool fromEnd = false)
+	bool IsValid()
+	{
+		return file->good();
+	}
+
+	void SetOffset(__int64 offset, bool fromEnd = false)
 	{
 		file->seekg(fromEnd ? -offset : offset, fromEnd ? ios::end : ios::beg);
 	}
@@ -137,6 +142,13 @@ public:
 		return retval;
 	}
 
+	__int64 ReadInt64()
+	{
+		__int64 retval = 0;
+		file->read((char*)&retval, (streamsize)sizeof(retval));
+		return retval;
+	}
+
 	char ReadByte()
 	{
 		char retval = 0;
@@ -144,34 +156,90 @@ public:
 		return retval;
 	}
 
-	string ReadData(long size)
+	//reads exactly 'size' bytes into the caller's buffer; returns false if the stream ends earlier
+	bool ReadData(void* buffer, size_t size)
+	{
+		file->read((char*)buffer, (streamsize)size);
+		return file->gcount() == (streamsize)size;
+	}
+
+	//returns empty buffer if the data does not fit into the process memory
+	string ReadData(__int64 size)
 	{
 		string buffer;
-		buffer.resize(size);
+		if (size < 0 || (unsigned __int64)size > buffer.max_size())
+			return buffer;
+
+		//max_size is far beyond what the 32-bit process can actually allocate
+		try
+		{
+			buffer.resize((size_t)size);
+		}
+		catch (bad_alloc&)
+		{
+			return string();
+		}
+
 		file->read((char*)buffer.data(), (streamsize)buffer.size());
 
 		return buffer;
 	}
 
-	wstring ReadString(long charCount)
+	wstring ReadString(__int64 charCount)
 	{
 		wstring buffer;
-		buffer.resize(charCount);
-		file->read((char*)buffer.data(), (streamsize)charCount * sizeof(WCHAR));
+		if (charCount < 0 || (unsigned __int64)charCount > buffer.max_size())
+			return buffer;
+
+		try
+		{
+			buffer.resize((size_t)charCount);
+		}
+		catch (bad_alloc&)
+		{
+			return wstring();
+		}
+
+		file->read((char*)buffer.data(), (streamsize)buffer.size() * sizeof(WCHAR));
 
 		return buffer;
 	}
 
+	//returns -1 if the file cannot be accessed
+	static __int64 Length(wstring fileName)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA info;
+		if (!GetFileAttributesExW(fileName.c_str(), GetFileExInfoStandard, &info))
+			return -1;
+
+		return ((__int64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	}
+
+	//returns empty buffer if the file cannot be read or does not fit into the process memory
 	static string ReadToEnd(wstring fileName)
 	{
 		string buffer;
-		string asciFileName = (LPCSTR)_bstr_t(fileName.c_str());
-		ifstream file(asciFileName.c_str(), ios::in | ios::binary);
-		size_t fileSize = static_cast<size_t>(file.seekg(0, ios::end).tellg());
-		buffer.resize(fileSize);
+		ifstream file(fileName.c_str(), ios::in | ios::binary);
+
+		streamoff fileSize = file.seekg(0, ios::end).tellg();
+		if (fileSize <= 0 || (unsigned __int64)fileSize > buffer.max_size())
+			return buffer;
+
+		try
+		{
+			buffer.resize((size_t)fileSize);
+		}
+		catch (bad_alloc&)
+		{
+			return string();
+		}
+
 		file.seekg(0)
 			.read((char*)buffer.data(), (streamsize)buffer.size());
 
+		if (file.gcount() != (streamsize)buffer.size())
+			buffer.clear();
+
 		return buffer;
 	}
 };
@@ -187,26 +255,50 @@ public:
 		delete file;
 	}
 
-	OutputStream(wstring name)
+	OutputStream(wstring name, bool append = false)
 	{
 		this->name = name;
-		this->file = new ofstream(name.c_str(), ios::out | ios::binary);
+		this->file = new ofstream(name.c_str(), append ? ios::out | ios::binary | ios::app : ios::out | ios::binary);
+	}
+
+	bool IsValid()
+	{
+		return file->good();
 	}
 
-	void SetOffset(long offset, bool fromEnd = false)
+	void SetOffset(__int64 offset, bool fromEnd = false)
 	{
 		file->seekp(fromEnd ? -offset : offset, fromEnd ? ios::end : ios::beg);
 	}
 
 	void WriteData(string& data)
 	{
-		file->write((char*)data.data(), data.size());
+		file->write((char*)data.data(), (streamsize)data.size());
+	}
+
+	//copies the data in chunks so the size is not limited by the process memory
+	bool WriteData(InputStream& input, __int64 size)
+	{
+		const streamsize chunkSize = 1024 * 1024;
+		string buffer;
+		buffer.resize((size_t)chunkSize);
+
+		while (size > 0)
+		{
+			streamsize count = size < chunkSize ? (streamsize)size : chunkSize;
+
+			if (!input.ReadData((void*)buffer.data(), (size_t)count))
+				return false;
+
+			file->write(buffer.data(), count);
+			size -= count;
+		}
+		return file->good();
 	}
 
 	void WriteString(wstring data)
 	{
-		long size = data.length() * sizeof(WCHAR);
-		file->write((char*)data.data(), size);
+		file->write((char*)data.data(), (streamsize)data.length() * sizeof(WCHAR));
 	}
 
 	void WriteLong(long data)
@@ -214,6 +306,11 @@ public:
 		file->write((char*)&data, (streamsize)sizeof(data));
 	}
 
+	void WriteInt64(__int64 data)
+	{
+		file->write((char*)&data, (streamsize)sizeof(data));
+	}
+
 	void WriteByte(char data)
 	{
 		file->write(&data, (streamsize)sizeof(data));
@@ -221,8 +318,7 @@ public:
 
 	static void Write(wstring fileName, string data)
 	{
-		string asciFileName = (LPCSTR)_bstr_t(fileName.c_str());
-		ofstream file(asciFileName.c_str(), ios::out | ios::binary);
+		ofstream file(fileName.c_str(), ios::out | ios::binary);
 		file.write((char*)data.data(), (streamsize)data.size());
 	}
 };
@@ -289,6 +385,43 @@ public:
 	}
 };
 
+//Batches multiple resource updates into a single BeginUpdateResource/EndUpdateResource session,
+//so the file is rewritten only once. The changes are discarded unless Commit is called.
+class ResourceUpdate
+{
+	HANDLE handle;
+
+public:
+	ResourceUpdate(wstring file)
+	{
+		handle = ::BeginUpdateResourceW(file.c_str(), FALSE);
+	}
+
+	~ResourceUpdate()
+	{
+		if (handle != NULL)
+			::EndUpdateResource(handle, TRUE); // discard changes
+	}
+
+	bool IsValid()
+	{
+		return handle != NULL;
+	}
+
+	//UpdateResource keeps its own copy of the data, so the buffer can be released right after the call
+	bool Replace(wstring resType, int resId, const string& data)
+	{
+		return handle != NULL && ::UpdateResource(handle, resType.c_str(), MAKEINTRESOURCE(resId), MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US), (LPVOID)data.data(), data.length()) ? true : false;
+	}
+
+	bool Commit()
+	{
+		BOOL retval = handle != NULL && ::EndUpdateResource(handle, FALSE); // write changes
+		handle = NULL;
+		return retval ? true : false;
+	}
+};
+
 class Path
 {
 public:
@@ -303,10 +436,15 @@ public:
 	}
 
 	static wstring GetFullPath(wstring path)
+	{
+		return GetFullPath(path, Path::CurrentDirectory());
+	}
+
+	static wstring GetFullPath(wstring path, wstring baseDir)
 	{
 		if (PathIsRelativeW(path.c_str()))
 		{
-			return Path::Combine(Path::CurrentDirectory(), path);
+			return Path::Combine(baseDir, path);
 		}
 		else
 		{
@@ -4,6 +4,8 @@
 #include "atlbase.h"
 #include "utils.h"
 #include "resource.h"
+#include "Service.h"
+#include "PEImage.h"
 
 // #include "afxres.h"
 #include "winres.h"
@@ -11,7 +13,16 @@
 //{185F1B47-C267-4cfd-B55F-EB89DAF3B4E3}
 //char markerData[] = { 0x18, 0x5F, 0x1B, 0x47, 0xC2, 0x67, 0x4c, 0xFD, 0xB5, 0x5F, 0xEB, 0x89, 0xDA, 0xF3, 0xB4, 0xE3 };
 
-void EmbeddWinResources(wstring outFile, wstring msiFile1, wstring msiFile2, wstring regKey, bool varify);
+int Build(vector<wstring>& args, wstring curDir, BuildCache& cache, string& output);
+bool EmbeddWinResources(BuildCache& cache, wstring outFile, wstring msiFile1, wstring msiFile2, wstring regKey, bool verify, string& output);
+
+//input file appended to the bootstrapper instead of being embedded as a resource
+struct OverlayPayload
+{
+	wstring file;
+	PayloadReference reference;
+	string digest;
+};
 
 #define IDR_CUSTOM_PRIMARY_DATA         131
 #define IDR_CUSTOM_PRIMARY_NAME         132
@@ -19,9 +30,23 @@ void EmbeddWinResources(wstring outFile, wstring msiFile1, wstring msiFile2, wst
 #define IDR_CUSTOM_PREREQ_NAME          134
 #define IDR_CUSTOM_CONDITION            135
 #define IDR_CUSTOM_VERIFY               136
+#define IDR_CUSTOM_BUILD_ID             137
+#define IDR_CUSTOM_PAYLOAD_FORMAT       138
 #define IDI_nbs                         107
 #define IDI_SMALL                       108
 
+//all build output goes through the buffer so it can be sent back to the client when running as a build server
+void Print(string& output, const char* format, ...)
+{
+	char buf[4096];
+	va_list args;
+	va_start(args, format);
+	_vsnprintf_s(buf, _countof(buf), _TRUNCATE, format, args);
+	va_end(args);
+
+	output += buf;
+}
+
 //void TestIcon();
 //void InjectMainIcon(WCHAR *Where, WCHAR *What);
 int _tmain(int argc, _TCHAR* argv[])
@@ -50,32 +75,71 @@ int _tmain(int argc, _TCHAR* argv[])
    //DWORD ttt = GetPrivateProfileStringW(L"Input", L"InstallType0", L"ffff", val,100, L"E:\\Galos\\Projects\\WixSharp\\Main\\NetStrapper\\Debug\\mbsbuilder.ini");
 
    //ATLASSERT(FALSE);
-	printf("Building bootstrapper...\n");
+	WCHAR* lpCmdLine = GetCommandLineW();
+	vector<wstring> args = Application::ParseCommandLine(lpCmdLine);
 	wstring curDir = Path::CurrentDirectory();
 
-	wstring outFile, msiFile1, msiFile2, regKey;
+	bool local = false;
+	bool stopServer = false;
+	for (UINT i = 1; i < args.size(); i++)
+	{
+		if (args[i] == L"/server")
+		{
+			printf("Build server is listening on %S\n", BuildServer::PipeName().c_str());
+			printf("Use 'nbsbuilder /server:stop' to stop the server.\n");
+			return BuildServer::Run(Build);
+		}
+		else if (args[i] == L"/server:stop")
+		{
+			stopServer = true;
+		}
+		else if (args[i] == L"/local")
+		{
+			local = true;
+		}
+	}
+
+	int exitCode;
+	string output;
+
+	if (local || !BuildClient::Send(lpCmdLine, curDir, exitCode, output))
+	{
+		if (stopServer)
+		{
+			printf("Build server is not running.\n");
+			return 0;
+		}
+
+		BuildCache cache(0); //nothing to reuse within a single build
+		exitCode = Build(args, curDir, cache, output);
+	}
+
+	printf("%s", output.c_str());
+	return exitCode;
+}
+
+int Build(vector<wstring>& args, wstring curDir, BuildCache& cache, string& output)
+{
+	wstring outFile, msiFile1, msiFile2, regKey, buildIdFile;
 	bool helpRequested = false;
 	bool verify = true;
 
-	WCHAR* lpCmdLine = GetCommandLineW();
-	vector<wstring> args = Application::ParseCommandLine(lpCmdLine);
-
 	for (UINT i = 1; i < args.size(); i++)
 	{
 		if (Utils::StartWith(args[i], L"/out:"))
 		{
 			outFile = Utils::Substring(args[i], wcslen(L"/out:"));
-			outFile = Path::GetFullPath(outFile);
+			outFile = Path::GetFullPath(outFile, curDir);
 		}
 		else if (Utils::StartWith(args[i], L"/first:"))
 		{
 			msiFile1 = Utils::Substring(args[i], wcslen(L"/first:"));
-			msiFile1 = Path::GetFullPath(msiFile1);
+			msiFile1 = Path::GetFullPath(msiFile1, curDir);
 		}
 		else if (Utils::StartWith(args[i], L"/second:"))
 		{
 			msiFile2 = Utils::Substring(args[i], wcslen(L"/second:"));
-			msiFile2 = Path::GetFullPath(msiFile2);
+			msiFile2 = Path::GetFullPath(msiFile2, curDir);
 		}
 		else if (args[i] == L"/verify:no")
 		{
@@ -86,6 +150,11 @@ int _tmain(int argc, _TCHAR* argv[])
 			regKey = Utils::Substring(args[i], wcslen(L"/reg:"));
 			vector<wstring> tokens = Utils::Split(L"HKLM:SOFTWARE\\Microsoft\\.NETFramework:", L':');
 		}
+		else if (Utils::StartWith(args[i], L"/buildid:"))
+		{
+			buildIdFile = Utils::Substring(args[i], wcslen(L"/buildid:"));
+			buildIdFile = Path::GetFullPath(buildIdFile, curDir);
+		}
 		else if (args[i] == L"/help" || args[i] == L"/?")
 		{
 			helpRequested = true;
@@ -94,57 +163,83 @@ int _tmain(int argc, _TCHAR* argv[])
 
 	if (helpRequested || args.size() == 1)
 	{
-		printf("Native Bootstrapper Builder v 1.0.0\n");
-		printf("Copyright (C) 2010 Oleg Shilo. \n");
-		printf("\n");
-		printf("Builds simple native (Win32) bootstrapper. It alows building a bootstrapper for\n");
-		printf("two deployment applications: primary setup and its prerequisite.\n");
-		printf("\n");
-		printf("NBSBUILDER /out:<outFile> /first:<firstMSI> /second:<secondMSI> /regkey:<reg> [/verify:<yes|no>] [/icon:<path>]\n");
-		printf("\n");
-		printf(" first  - the setup application to be run the first (prerequisite).\n");
-		printf("\n");
-		printf(" second - the setup application to be run the second (after\n");
-		printf("          running prerequisite)\n");
-		printf("\n");
-		printf(" out    - name of the output file (bootstrapper) to produce\n");
-		printf("\n");
-		printf(" reg    - the registry key that indicates if firstMSI should be run.\n");
-		printf("          If the 'reg' value exists in registry the firstMSI will be\n");
-		printf("          considered already installed and will not run.\n");
-		printf("          Registry value should comply with the following pattern.\n");
-		printf("          <HKEY>:<SubKey>:ValueName>\n");
-		printf("\n");
-		printf("          Examples:\n");
-		printf("           'HLKM:SOFTWARE\\Microsoft\\.NETFramework\\v2.0.50727:' .NET v2.0,\n");
-		printf("           'HLKM:SOFTWARE\\Microsoft\\.NETFramework:' any version of .NET,\n");
-		printf("           'HLKM:SOFTWARE\\MyCompany\\MiProduct:InstallDir' InstallDir value\n");
-		printf("\n");
-		printf(" verify - flag (yes/no) indicating if the registry key (/regkey:<reg>)\n");
-		printf("          should be checked again after running prerequisite. Default: yes.\n");
+		Print(output, "Native Bootstrapper Builder v 1.0.0\n");
+		Print(output, "Copyright (C) 2010 Oleg Shilo. \n");
+		Print(output, "\n");
+		Print(output, "Builds simple native (Win32) bootstrapper. It alows building a bootstrapper for\n");
+		Print(output, "two deployment applications: primary setup and its prerequisite.\n");
+		Print(output, "\n");
+		Print(output, "NBSBUILDER /out:<outFile> /first:<firstMSI> /second:<secondMSI> /regkey:<reg> [/verify:<yes|no>] [/icon:<path>] [/local]\n");
+		Print(output, "NBSBUILDER /buildid:<bootstrapper>\n");
+		Print(output, "NBSBUILDER /server | /server:stop\n");
+		Print(output, "\n");
+		Print(output, " first  - the setup application to be run the first (prerequisite).\n");
+		Print(output, "\n");
+		Print(output, " second - the setup application to be run the second (after\n");
+		Print(output, "          running prerequisite)\n");
+		Print(output, "\n");
+		Print(output, " out    - name of the output file (bootstrapper) to produce\n");
+		Print(output, "\n");
+		Print(output, " reg    - the registry key that indicates if firstMSI should be run.\n");
+		Print(output, "          If the 'reg' value exists in registry the firstMSI will be\n");
+		Print(output, "          considered already installed and will not run.\n");
+		Print(output, "          Registry value should comply with the following pattern.\n");
+		Print(output, "          <HKEY>:<SubKey>:ValueName>\n");
+		Print(output, "\n");
+		Print(output, "          Examples:\n");
+		Print(output, "           'HLKM:SOFTWARE\\Microsoft\\.NETFramework\\v2.0.50727:' .NET v2.0,\n");
+		Print(output, "           'HLKM:SOFTWARE\\Microsoft\\.NETFramework:' any version of .NET,\n");
+		Print(output, "           'HLKM:SOFTWARE\\MyCompany\\MiProduct:InstallDir' InstallDir value\n");
+		Print(output, "\n");
+		Print(output, " verify - flag (yes/no) indicating if the registry key (/regkey:<reg>)\n");
+		Print(output, "          should be checked again after running prerequisite. Default: yes.\n");
+		Print(output, "\n");
+		Print(output, " buildid - print the build ID of the already built bootstrapper. Bootstrappers\n");
+		Print(output, "          built from the same input are identical and have the same build ID.\n");
+		Print(output, "\n");
+		Print(output, " local  - build in this process even if the build server is running.\n");
+		Print(output, "\n");
+		Print(output, " server - start the build server. While it is running any other nbsbuilder\n");
+		Print(output, "          invocation (of the same user) is forwarded to the server, which\n");
+		Print(output, "          keeps the launcher and the input files cached between builds.\n");
+		Print(output, "          'server:stop' stops the running server.\n");
 		// printf("\n");
 		 //printf(" icon   - path to the icon file for the bootstrapper.\n");
 
 		return 0;
 	}
+	if (buildIdFile.length() != 0)
+	{
+		string buildId = PEImage::ReadResource(buildIdFile, L"CUSTOM", IDR_CUSTOM_BUILD_ID);
+		if (buildId.empty())
+		{
+			Print(output, "The build ID cannot be read from %S.\n", buildIdFile.c_str());
+			return 1;
+		}
+		Print(output, "%S\n", Sha256::ToHex(buildId).c_str());
+		return 0;
+	}
+
+	Print(output, "Building bootstrapper...\n");
+
 	if (msiFile1.length() == 0 || !Path::FileExists(msiFile1))
 	{
-		printf("The 'first' argument was not specified or incorrect.\n");
+		Print(output, "The 'first' argument was not specified or incorrect.\n");
 		return 1;
 	}
 	if (msiFile2.length() == 0 || !Path::FileExists(msiFile2))
 	{
-		printf("The 'second' argument was not specified or is incorrect.\n");
+		Print(output, "The 'second' argument was not specified or is incorrect.\n");
 		return 1;
 	}
 	if (outFile.length() == 0)
 	{
-		printf("You to have to specify '/out:' argument (output file).\n");
+		Print(output, "You to have to specify '/out:' argument (output file).\n");
 		return 1;
 	}
 	if (regKey.length() == 0)
 	{
-		printf("You have to specify '/reg:' argument (refistry value for the prerequisite file).\n");
+		Print(output, "You have to specify '/reg:' argument (refistry value for the prerequisite file).\n");
 		return 1;
 	}
 
@@ -157,92 +252,242 @@ int _tmain(int argc, _TCHAR* argv[])
 	wstring regKey = L"1234567890";
 	*////////////////////////////////////////
 
-	EmbeddWinResources(outFile, msiFile1, msiFile2, regKey, verify);
+	bool success = false;
+	try
+	{
+		success = EmbeddWinResources(cache, outFile, msiFile1, msiFile2, regKey, verify, output);
+	}
+	catch (bad_alloc&)
+	{
+		cache.Clear();
+		Print(output, "\nError: not enough memory to build the bootstrapper.\n");
+	}
+	cache.EndBuild();
+
+	//the bare (or partially updated) launcher must not be mistaken for the successfully built bootstrapper
+	if (!success)
+		::DeleteFileW(outFile.c_str());
 
-	return 0;
+	return success ? 0 : 1;
 }
 
-void EmbeddCustomResources(wstring outFile, wstring msiFile1, wstring msiFile2, wstring regKey)
+//Reads the file in chunks, hashes it and (optionally) appends it to the output.
+//Returns false if the file cannot be read or written.
+bool HashFile(wstring file, ULONGLONG size, OutputStream* output, string& digest)
 {
-	string launcherData = Resources::Read(IDR_CUSTOM1, L"CUSTOM");
+	InputStream input(file);
+	Sha256 hash;
 
-	OutputStream file(outFile);
+	string buffer;
+	buffer.resize(NBS_PAYLOAD_BLOCK_SIZE);
 
-	//Launcher (bootstrapper)
-	file.WriteData(launcherData);
+	while (size > 0 && input.IsValid())
+	{
+		size_t count = size < buffer.size() ? (size_t)size : buffer.size();
+		if (!input.ReadData((void*)buffer.data(), count))
+			return false;
+
+		hash.Append(buffer.data(), count);
+		if (output)
+		{
+			if (count < buffer.size())
+				buffer.resize(count);
+			output->WriteData(buffer);
+		}
+		size -= count;
+	}
 
-	//resource marker
-   /* for (int i = 0; i < sizeof(markerData); i++)
-		file.WriteByte(markerData[i]);*/
+	digest = hash.Digest();
+	return size == 0 && !digest.empty() && (output == NULL || output->IsValid());
+}
 
-		//First MSI
-	string data = InputStream::ReadToEnd(msiFile1);
-	file.WriteLong(data.size());
-	file.WriteData(data);
+//Appends the payloads that are too large to be resources after the end of the image (overlay, see
+//Payload.h). Their content has been hashed into the build ID before the resources were committed; it is
+//hashed again while copying so a file modified in the meantime fails the build.
+bool EmbeddCustomResources(wstring outFile, vector<OverlayPayload>& payloads, string& output)
+{
+	if (payloads.empty())
+		return true;
 
-	wstring fileName = Path::GetFileName(msiFile1);
-	file.WriteLong(fileName.size());
-	file.WriteString(fileName);
+	//the launcher locates the payloads by the end of its last section so nothing can be in between
+	string headers;
+	headers.resize(NBS_HEADERS_SIZE);
+	{
+		InputStream image(outFile);
+		if (!image.ReadData((void*)headers.data(), headers.size())
+			|| Payload::ImageEnd((const BYTE*)headers.data(), (DWORD)headers.size()) != InputStream::Length(outFile))
+		{
+			Print(output, "\nError: cannot append the input files to %S (unexpected image layout).\n", outFile.c_str());
+			return false;
+		}
+	}
 
-	//Second MSI
-	data = InputStream::ReadToEnd(msiFile2);
-	file.WriteLong(data.size());
-	file.WriteData(data);
+	OutputStream file(outFile, true);
 
-	fileName = Path::GetFileName(msiFile2);
-	file.WriteLong(fileName.size());
-	file.WriteString(fileName);
+	for (size_t i = 0; i < payloads.size(); i++)
+	{
+		string digest;
+		if (!HashFile(payloads[i].file, payloads[i].reference.size, &file, digest))
+		{
+			Print(output, "\nError: cannot copy %S to %S.\n", payloads[i].file.c_str(), outFile.c_str());
+			return false;
+		}
+		if (digest != payloads[i].digest)
+		{
+			Print(output, "\nError: %S has been modified during the build.\n", payloads[i].file.c_str());
+			return false;
+		}
+	}
+	return true;
+}
 
-	//Registry key
-	int t = regKey.size();
-	file.WriteLong(regKey.size());
-	file.WriteString(regKey);
+void PrintPayload(string& output, const char* title, wstring file, PayloadStats& stats)
+{
+	Print(output, "\n%s: %S\n", title, Path::GetFileName(file).c_str());
+	if (stats.appended)
+	{
+		Print(output, " Size         : %I64u bytes, appended to the bootstrapper\n", stats.size);
+		return;
+	}
+	Print(output, " Codec        : %s (entropy %.2f bits/byte)\n", stats.CodecName(), stats.entropy);
+	Print(output, " Size         : %I64u -> %I64u bytes, %d of %d blocks stored\n", stats.size, stats.packedSize,
+		stats.codec == NBS_CODEC_STORE ? stats.blocks : stats.storedBlocks, stats.blocks);
+	Print(output, " Ratio        : %.3f predicted, %.3f actual\n", stats.predictedRatio, stats.ActualRatio());
+}
 
-	//Data offset
-	//file.WriteLong(launcherData.length());
+//adds the resource to the update and to the build ID
+bool AddResource(ResourceUpdate& update, Sha256& buildId, int id, const string& data)
+{
+	ULONGLONG size = data.size();
+	buildId.Append(&id, sizeof(id));
+	buildId.Append(&size, sizeof(size));
+	buildId.Append(data);
 
-	printf("\n\nSuccess: bootstrapper file has been built (%S).\n", outFile.c_str());
+	return update.Replace(L"CUSTOM", id, data);
 }
 
-void EmbeddWinResources(wstring outFile, wstring msiFile1, wstring msiFile2, wstring regKey, bool verify)
+//The payloads are packed and added one at a time. UpdateResource keeps its own copy of the data so
+//the builder holds only one packed payload at any time. The files larger than NBS_MAX_RESOURCE_PAYLOAD
+//are only hashed here; the resource holds the reference and the file is appended after the commit.
+bool AddPayload(BuildCache& cache, ResourceUpdate& update, Sha256& buildId, int dataId, int nameId, wstring file, PayloadStats& stats, vector<OverlayPayload>& overlay, bool& loaded)
 {
-	//Launcher (bootstrapper)
+	__int64 size = InputStream::Length(file);
+
+	if (size > NBS_MAX_RESOURCE_PAYLOAD)
 	{
-		OutputStream file(outFile);
-		file.WriteData(Resources::Read(IDR_CUSTOM1, L"CUSTOM"));
+		OverlayPayload payload;
+		payload.file = file;
+		ZeroMemory(&payload.reference, sizeof(payload.reference));
+		payload.reference.magic = NBS_OVERLAY_MAGIC;
+		payload.reference.offset = overlay.empty() ? 0 : overlay.back().reference.offset + overlay.back().reference.size;
+		payload.reference.size = size;
+
+		if (!HashFile(file, size, NULL, payload.digest))
+		{
+			loaded = false;
+			return false;
+		}
+		buildId.Append(payload.digest);
+		overlay.push_back(payload);
+
+		ZeroMemory(&stats, sizeof(stats));
+		stats.size = stats.packedSize = size;
+		stats.appended = true;
+
+		return AddResource(update, buildId, dataId, string((const char*)&payload.reference, sizeof(payload.reference)))
+			&& AddResource(update, buildId, nameId, Utils::StringToData(Path::GetFileName(file)));
 	}
 
-	//First MSI
-	string data = InputStream::ReadToEnd(msiFile1);
-	Resources::ReplaceResource(outFile, L"CUSTOM", IDR_CUSTOM_PREREQ_DATA, data);
+	const string& data = cache.ReadPayload(file, stats);
+	if (data.empty())
+	{
+		loaded = false;
+		return false;
+	}
 
-	wstring fileName = Path::GetFileName(msiFile1);
-	Resources::ReplaceResource(outFile, L"CUSTOM", IDR_CUSTOM_PREREQ_NAME, Utils::StringToData(fileName));
+	return AddResource(update, buildId, dataId, data)
+		&& AddResource(update, buildId, nameId, Utils::StringToData(Path::GetFileName(file)));
+}
 
-	//Second MSI
-	data = InputStream::ReadToEnd(msiFile2);
-	Resources::ReplaceResource(outFile, L"CUSTOM", IDR_CUSTOM_PRIMARY_DATA, data);
+bool EmbeddWinResources(BuildCache& cache, wstring outFile, wstring msiFile1, wstring msiFile2, wstring regKey, bool verify, string& output)
+{
+	//Build ID is the hash of everything that goes into the bootstrapper. It is embedded as the last
+	//resource and (truncated) as the image time stamp, so identical inputs produce identical files.
+	Sha256 buildId;
 
-	wstring fileName2 = Path::GetFileName(msiFile2);
-	Resources::ReplaceResource(outFile, L"CUSTOM", IDR_CUSTOM_PRIMARY_NAME, Utils::StringToData(fileName2));
+	//Launcher (bootstrapper)
+	{
+		OutputStream file(outFile);
+		file.WriteData(cache.Launcher());
+		buildId.Append(cache.Launcher());
 
-	//Registry key
-	Resources::ReplaceResource(outFile, L"CUSTOM", IDR_CUSTOM_CONDITION, Utils::StringToData(regKey));
+		if (!file.IsValid())
+		{
+			Print(output, "\nError: cannot write %S.\n", outFile.c_str());
+			return false;
+		}
+	}
 
-	//verify
-	Resources::ReplaceResource(outFile, L"CUSTOM", IDR_CUSTOM_VERIFY, Utils::StringToData(verify ? L"yes" : L"no"));
+	//a launcher built before the payload format was introduced would extract the packed data as is
+	DWORD payloadMagic = NBS_PAYLOAD_MAGIC;
+	if (PEImage::ReadResource(outFile, L"CUSTOM", IDR_CUSTOM_PAYLOAD_FORMAT) != string((const char*)&payloadMagic, sizeof(payloadMagic)))
+	{
+		Print(output, "\nError: the embedded launcher (nbs.exe) does not support the payload format. Rebuild nbs and then nbsbuilder.\n");
+		return false;
+	}
+
+	//all resources are written in a single update session (in the ascending order of the resource ids)
+	//so the file is rewritten only once; the update is discarded (not committed) if any of them cannot be added
+	ResourceUpdate update(outFile);
+	PayloadStats primaryStats, prereqStats;
+	vector<OverlayPayload> overlay;
+	bool loaded = true;
+
+	bool updated = update.IsValid()
+		&& AddPayload(cache, update, buildId, IDR_CUSTOM_PRIMARY_DATA, IDR_CUSTOM_PRIMARY_NAME, msiFile2, primaryStats, overlay, loaded)
+		&& AddPayload(cache, update, buildId, IDR_CUSTOM_PREREQ_DATA, IDR_CUSTOM_PREREQ_NAME, msiFile1, prereqStats, overlay, loaded)
+		&& AddResource(update, buildId, IDR_CUSTOM_CONDITION, Utils::StringToData(regKey))
+		&& AddResource(update, buildId, IDR_CUSTOM_VERIFY, Utils::StringToData(verify ? L"yes" : L"no"));
+
+	//the payloads embedded as resources have to be loaded into the builder process memory
+	if (!loaded)
+	{
+		Print(output, "\nError: cannot read the input files or load them into memory.\n");
+		return false;
+	}
+
+	string buildIdData = buildId.Digest();
+	updated = updated && !buildIdData.empty() && update.Replace(L"CUSTOM", IDR_CUSTOM_BUILD_ID, buildIdData);
 
 	//icon
 	//data = InputStream::ReadToEnd(L"E:\\cs-script\\engine\\Logo\\css_logo.ico");
 	//Resources::ReplaceResource(outFile, RT_GROUP_ICON, IDI_nbs, data);
 	//Resources::ReplaceResource(outFile, RT_GROUP_ICON, IDI_SMALL, data);
 
-	printf("\nSuccess: \n");
-	printf(" Bootstrapper : %S.\n", Path::GetFileName(outFile).c_str());
-	printf(" Prerequisite : %S.\n", Path::GetFileName(fileName).c_str());
-	printf(" RegKey value : %S\n", regKey.c_str());
-	printf(" Post-verify  : %S\n", verify ? L"yes" : L"no");
-	printf("\nPrerequisite will be installed if the registry key value (above) is not found at the installation time.\n\n");
+	DWORD timeStamp = 0;
+	memcpy(&timeStamp, buildIdData.data(), min(sizeof(timeStamp), buildIdData.size()));
+
+	if (!updated || !update.Commit() || !PEImage::Normalize(outFile, timeStamp))
+	{
+		Print(output, "\nError: cannot embed resources into %S (error %d).\n", outFile.c_str(), GetLastError());
+		return false;
+	}
+
+	if (!EmbeddCustomResources(outFile, overlay, output))
+		return false;
+
+	PrintPayload(output, "Prerequisite", msiFile1, prereqStats);
+	PrintPayload(output, "Primary setup", msiFile2, primaryStats);
+
+	Print(output, "\nSuccess: \n");
+	Print(output, " Bootstrapper : %S.\n", Path::GetFileName(outFile).c_str());
+	Print(output, " Prerequisite : %S.\n", Path::GetFileName(msiFile1).c_str());
+	Print(output, " RegKey value : %S\n", regKey.c_str());
+	Print(output, " Post-verify  : %S\n", verify ? L"yes" : L"no");
+	Print(output, " Build ID     : %S\n", Sha256::ToHex(buildIdData).c_str());
+	Print(output, "\nPrerequisite will be installed if the registry key value (above) is not found at the installation time.\n\n");
+
+	return true;
 }
 
 void TestIcon()